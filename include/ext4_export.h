@@ -0,0 +1,13 @@
+#ifndef EXT4_EXPORT_H
+#define EXT4_EXPORT_H
+
+#include <stdio.h>
+
+#include "ext4_fs.h"
+
+// Image data is copied through this single buffer, it must hold at least one block (64K max)
+#define EXPORT_BUFFER_SIZE (64 * 1024)
+
+uint8_t export_tar(struct ext4_fs *fs, const char *path, FILE *out);
+
+#endif /* EXT4_EXPORT_H */
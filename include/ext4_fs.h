@@ -15,8 +15,30 @@ struct ext4_fs {
     uint32_t inodes_per_group;
 };
 
+struct ext4_time {
+    int64_t sec;
+    uint32_t nsec;
+};
+
+/*
+ * Called for every run of physically contiguous blocks of an inode.
+ * Holes and uninitialized extents are never reported.
+ * Return 0 to stop the walk.
+ */
+typedef uint8_t (*ext4_block_run_cb)(void *ctx, uint32_t logical_block_num, uint64_t physical_block_num,
+                                     uint32_t count);
+
+/*
+ * Called for every used directory entry. The entry points into a block
+ * buffer owned by the walker and is valid only during the call.
+ * Return 0 to stop the walk.
+ */
+typedef uint8_t (*ext4_dir_entry_cb)(void *ctx, const struct ext4_dir_entry_2 *entry);
+
 uint8_t init_ext4_fs(const char *fname, struct ext4_fs *fs);
 
+void close_ext4_fs(struct ext4_fs *fs);
+
 uint8_t read_primary_super_block(struct ext4_fs *fs, struct ext4_super_block *sb);
 
 uint8_t read_super_block(struct ext4_fs *fs, struct ext4_super_block *sb, uint32_t block_num);
@@ -29,8 +51,28 @@ uint8_t read_inode(struct ext4_fs *fs, struct ext4_inode *inode, uint32_t inode_
 
 uint8_t read_physical_block(struct ext4_fs *fs, uint8_t *buffer, uint32_t physical_block_num);
 
+uint8_t read_physical_blocks(struct ext4_fs *fs, uint8_t *buffer, uint64_t physical_block_num, uint32_t count);
+
 uint8_t read_logical_block(struct ext4_fs *fs, struct ext4_inode *inode, uint8_t *buffer, uint32_t logical_block_num);
 
+uint8_t walk_inode_blocks(struct ext4_fs *fs, const struct ext4_inode *inode, ext4_block_run_cb cb, void *ctx);
+
+uint8_t walk_dir_entries(struct ext4_fs *fs, const struct ext4_inode *dir, ext4_dir_entry_cb cb, void *ctx);
+
+uint8_t lookup_path(struct ext4_fs *fs, const char *path, uint32_t *inode_num);
+
+uint64_t get_inode_size(const struct ext4_inode *inode);
+
+uint32_t get_inode_uid(const struct ext4_inode *inode);
+
+uint32_t get_inode_gid(const struct ext4_inode *inode);
+
+struct ext4_time get_inode_atime(const struct ext4_inode *inode);
+
+struct ext4_time get_inode_mtime(const struct ext4_inode *inode);
+
+struct ext4_time get_inode_ctime(const struct ext4_inode *inode);
+
 uint8_t is_valid_super_block(struct ext4_super_block *sb);
 
 #endif /* EXT4_FS_H */
@@ -5,6 +5,23 @@
 
 #define EXT4_S_MAGIC 0xEF53
 
+#define EXT4_ROOT_INO 2
+#define EXT4_GOOD_OLD_INODE_SIZE 128
+
+// i_mode file types
+#define EXT4_S_IFMT   0xF000
+#define EXT4_S_IFSOCK 0xC000
+#define EXT4_S_IFLNK  0xA000
+#define EXT4_S_IFREG  0x8000
+#define EXT4_S_IFBLK  0x6000
+#define EXT4_S_IFDIR  0x4000
+#define EXT4_S_IFCHR  0x2000
+#define EXT4_S_IFIFO  0x1000
+
+// i_flags
+#define EXT4_EXTENTS_FL     0x80000
+#define EXT4_INLINE_DATA_FL 0x10000000
+
 struct ext4_super_block {
     uint32_t s_inodes_count;
     uint32_t s_blocks_count_lo;
@@ -208,4 +225,39 @@ struct ext4_inode {
     uint8_t i_xattr[96];
 } __attribute__((packed));
 
+#define EXT4_EXT_MAGIC 0xF30A
+#define EXT4_EXT_INIT_MAX_LEN 32768 // ee_len above this marks an uninitialized extent
+
+struct ext4_extent_header {
+    uint16_t eh_magic;
+    uint16_t eh_entries;
+    uint16_t eh_max;
+    uint16_t eh_depth;
+    uint32_t eh_generation;
+} __attribute__((packed));
+
+struct ext4_extent_idx {
+    uint32_t ei_block;
+    uint32_t ei_leaf_lo;
+    uint16_t ei_leaf_hi;
+    uint16_t ei_unused;
+} __attribute__((packed));
+
+struct ext4_extent {
+    uint32_t ee_block;
+    uint16_t ee_len;
+    uint16_t ee_start_hi;
+    uint32_t ee_start_lo;
+} __attribute__((packed));
+
+#define EXT4_NAME_LEN 255
+
+struct ext4_dir_entry_2 {
+    uint32_t inode;
+    uint16_t rec_len;
+    uint8_t name_len;
+    uint8_t file_type;
+    char name[EXT4_NAME_LEN];
+} __attribute__((packed));
+
 #endif  /* EXT4_STRUCTS_H */
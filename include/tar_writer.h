@@ -0,0 +1,69 @@
+#ifndef TAR_WRITER_H
+#define TAR_WRITER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_PATH_MAX 4096
+// Enough for path or sparse name, linkpath and the fixed-size records
+#define TAR_PAX_BUFFER_SIZE (3 * TAR_PATH_MAX)
+
+#define TAR_TYPE_REGULAR  '0'
+#define TAR_TYPE_HARDLINK '1'
+#define TAR_TYPE_SYMLINK  '2'
+#define TAR_TYPE_CHAR     '3'
+#define TAR_TYPE_BLOCK    '4'
+#define TAR_TYPE_DIR      '5'
+#define TAR_TYPE_FIFO     '6'
+#define TAR_TYPE_PAX      'x'
+
+struct tar_time {
+    int64_t sec;
+    uint32_t nsec;
+};
+
+struct tar_entry {
+    const char *path;
+    const char *link_path; // Symlink target or hardlink source, NULL otherwise
+    char type;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t dev_major;
+    uint32_t dev_minor;
+    uint64_t size; // Bytes of data that follow the header
+    struct tar_time mtime;
+    struct tar_time atime;
+    struct tar_time ctime;
+    // GNU sparse 1.0: data starts with the sparse map, real_size is the expanded file size
+    uint8_t sparse;
+    uint64_t real_size;
+};
+
+struct tar_writer {
+    FILE *out;
+    uint64_t entry_remaining;
+    uint64_t entry_written;
+    char pax[TAR_PAX_BUFFER_SIZE];
+    size_t pax_len;
+    uint8_t write_failed; // Write errors are reported once, every later write fails quietly
+};
+
+void init_tar_writer(struct tar_writer *tw, FILE *out);
+
+uint8_t tar_write_header(struct tar_writer *tw, const struct tar_entry *entry);
+
+uint8_t tar_write_data(struct tar_writer *tw, const void *data, size_t len);
+
+uint8_t tar_align_data(struct tar_writer *tw);
+
+uint8_t tar_end_entry(struct tar_writer *tw);
+
+uint8_t tar_finish(struct tar_writer *tw);
+
+uint8_t tar_write_sparse_map_value(struct tar_writer *tw, uint64_t value);
+
+uint64_t tar_sparse_map_value_size(uint64_t value);
+
+#endif /* TAR_WRITER_H */
@@ -0,0 +1,465 @@
+#include "ext4_export.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ext4_structs.h"
+#include "tar_writer.h"
+
+struct hardlink {
+    uint32_t inode_num;
+    char *path;
+};
+
+struct export_ctx {
+    struct ext4_fs *fs;
+    struct tar_writer tw;
+    uint8_t *buffer;
+    char path[TAR_PATH_MAX];
+    size_t path_len;
+    // Open addressing hash table of multiply linked inodes, inode 0 marks a free slot
+    struct hardlink *links;
+    size_t links_count;
+    size_t links_capacity;
+    // Set when a directory walk is stopped by a child, whose failure is already reported
+    uint8_t child_failed;
+};
+
+/*
+ * Regular files are scanned twice before their data is copied: once to
+ * measure the GNU sparse map, once to write it. Only holey files get a map.
+ */
+struct file_layout {
+    struct export_ctx *ctx;
+    uint64_t size;
+    uint64_t data_size;
+    uint64_t chunk_count;
+    uint64_t map_size;
+    uint64_t chunk_offset;
+    uint64_t chunk_len;
+    uint8_t write_map;
+};
+
+struct file_stream {
+    struct export_ctx *ctx;
+    uint64_t size;
+};
+
+static uint8_t export_inode(struct export_ctx *ctx, uint32_t inode_num);
+
+static struct hardlink *find_hardlink_slot(const struct export_ctx *ctx, uint32_t inode_num) {
+    const size_t mask = ctx->links_capacity - 1;
+    size_t i = (inode_num * 2654435761u) & mask;
+
+    while (ctx->links[i].inode_num != 0 && ctx->links[i].inode_num != inode_num)
+        i = (i + 1) & mask;
+
+    return &ctx->links[i];
+}
+
+static uint8_t grow_hardlinks(struct export_ctx *ctx) {
+    struct hardlink *old_links = ctx->links;
+    const size_t old_capacity = ctx->links_capacity;
+
+    ctx->links_capacity = old_capacity == 0 ? 64 : old_capacity * 2;
+    ctx->links = calloc(ctx->links_capacity, sizeof(struct hardlink));
+    if (ctx->links == NULL) {
+        fprintf(stderr, "ERROR: Memory allocation for hardlink table failed\n");
+        ctx->links = old_links;
+        ctx->links_capacity = old_capacity;
+        return 0;
+    }
+
+    for (size_t i = 0; i < old_capacity; i++)
+        if (old_links[i].inode_num != 0)
+            *find_hardlink_slot(ctx, old_links[i].inode_num) = old_links[i];
+
+    free(old_links);
+    return 1;
+}
+
+// Returns the name the inode was first archived under, or NULL if it was not archived yet
+static const char *find_hardlink(const struct export_ctx *ctx, uint32_t inode_num) {
+    if (ctx->links_capacity == 0) return NULL;
+    return find_hardlink_slot(ctx, inode_num)->path;
+}
+
+// Called only once the inode has been written, so later links never point at a skipped member
+static uint8_t remember_hardlink(struct export_ctx *ctx, uint32_t inode_num) {
+    if (ctx->links_count * 2 >= ctx->links_capacity && !grow_hardlinks(ctx)) return 0;
+
+    struct hardlink *slot = find_hardlink_slot(ctx, inode_num);
+
+    slot->path = malloc(ctx->path_len + 1);
+    if (slot->path == NULL) {
+        fprintf(stderr, "ERROR: Memory allocation for hardlink path failed\n");
+        return 0;
+    }
+    memcpy(slot->path, ctx->path, ctx->path_len + 1);
+
+    slot->inode_num = inode_num;
+    ctx->links_count++;
+    return 1;
+}
+
+static void free_hardlinks(struct export_ctx *ctx) {
+    for (size_t i = 0; i < ctx->links_capacity; i++)
+        free(ctx->links[i].path);
+    free(ctx->links);
+}
+
+static struct tar_time to_tar_time(struct ext4_time time) {
+    return (struct tar_time) {.sec = time.sec, .nsec = time.nsec};
+}
+
+static uint8_t emit_chunk(struct file_layout *layout) {
+    if (layout->write_map) {
+        return tar_write_sparse_map_value(&layout->ctx->tw, layout->chunk_offset)
+               && tar_write_sparse_map_value(&layout->ctx->tw, layout->chunk_len);
+    }
+
+    layout->chunk_count++;
+    layout->map_size += tar_sparse_map_value_size(layout->chunk_offset)
+                        + tar_sparse_map_value_size(layout->chunk_len);
+    return 1;
+}
+
+static uint8_t add_chunk(void *ctx, uint32_t logical_block_num, uint64_t physical_block_num, uint32_t count) {
+    struct file_layout *layout = ctx;
+    const uint32_t block_size = layout->ctx->fs->block_size;
+    const uint64_t start = (uint64_t) logical_block_num * block_size;
+
+    // Blocks preallocated past the end of file are not part of its data
+    if (start >= layout->size) return 1;
+
+    uint64_t len = (uint64_t) count * block_size;
+    if (len > layout->size - start) len = layout->size - start;
+
+    if (!layout->write_map) layout->data_size += len;
+
+    if (layout->chunk_len > 0 && layout->chunk_offset + layout->chunk_len == start) {
+        layout->chunk_len += len;
+        return 1;
+    }
+
+    if (layout->chunk_len > 0 && !emit_chunk(layout)) return 0;
+
+    layout->chunk_offset = start;
+    layout->chunk_len = len;
+    return 1;
+}
+
+static uint8_t finish_chunks(struct file_layout *layout) {
+    if (layout->chunk_len > 0 && !emit_chunk(layout)) return 0;
+
+    // A trailing hole is stored as an empty chunk at the end so the file keeps its size
+    if (layout->chunk_offset + layout->chunk_len < layout->size) {
+        layout->chunk_offset = layout->size;
+        layout->chunk_len = 0;
+        return emit_chunk(layout);
+    }
+
+    return 1;
+}
+
+static uint8_t stream_block_run(void *ctx, uint32_t logical_block_num, uint64_t physical_block_num,
+                                uint32_t count) {
+    const struct file_stream *stream = ctx;
+    struct export_ctx *export = stream->ctx;
+    const uint32_t block_size = export->fs->block_size;
+    const uint32_t blocks_per_buffer = EXPORT_BUFFER_SIZE / block_size;
+    const uint64_t start = (uint64_t) logical_block_num * block_size;
+
+    if (start >= stream->size) return 1;
+
+    uint64_t remaining = (uint64_t) count * block_size;
+    if (remaining > stream->size - start) remaining = stream->size - start;
+
+    while (remaining > 0) {
+        const uint32_t blocks = count < blocks_per_buffer ? count : blocks_per_buffer;
+        const uint64_t len = (uint64_t) blocks * block_size < remaining ? (uint64_t) blocks * block_size : remaining;
+
+        if (!read_physical_blocks(export->fs, export->buffer, physical_block_num, blocks)) {
+            fprintf(stderr, "ERROR: Could not read data of %s\n", export->path);
+            return 0;
+        }
+
+        if (!tar_write_data(&export->tw, export->buffer, len)) return 0;
+
+        physical_block_num += blocks;
+        count -= blocks;
+        remaining -= len;
+    }
+
+    return 1;
+}
+
+static uint8_t export_regular(struct export_ctx *ctx, const struct ext4_inode *inode, struct tar_entry *entry) {
+    const uint64_t size = get_inode_size(inode);
+
+    if (inode->i_flags & EXT4_INLINE_DATA_FL) {
+        entry->size = size;
+        return tar_write_header(&ctx->tw, entry)
+               && tar_write_data(&ctx->tw, inode->i_block, size)
+               && tar_end_entry(&ctx->tw);
+    }
+
+    struct file_layout layout = {.ctx = ctx, .size = size};
+    if (!walk_inode_blocks(ctx->fs, inode, add_chunk, &layout) || !finish_chunks(&layout)) {
+        fprintf(stderr, "ERROR: Could not map blocks of %s\n", ctx->path);
+        return 0;
+    }
+
+    entry->size = size;
+
+    if (layout.data_size < size) {
+        uint64_t map_size = layout.map_size + tar_sparse_map_value_size(layout.chunk_count);
+        map_size = (map_size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+
+        entry->sparse = 1;
+        entry->real_size = size;
+        entry->size = map_size + layout.data_size;
+
+        struct file_layout map = {.ctx = ctx, .size = size, .write_map = 1};
+        if (!tar_write_header(&ctx->tw, entry)
+            || !tar_write_sparse_map_value(&ctx->tw, layout.chunk_count)
+            || !walk_inode_blocks(ctx->fs, inode, add_chunk, &map)
+            || !finish_chunks(&map)
+            || !tar_align_data(&ctx->tw))
+            return 0;
+    } else if (!tar_write_header(&ctx->tw, entry)) {
+        return 0;
+    }
+
+    struct file_stream stream = {.ctx = ctx, .size = size};
+    return walk_inode_blocks(ctx->fs, inode, stream_block_run, &stream) && tar_end_entry(&ctx->tw);
+}
+
+static uint8_t read_symlink_run(void *ctx, uint32_t logical_block_num, uint64_t physical_block_num,
+                                uint32_t count) {
+    const struct file_stream *stream = ctx;
+    const uint32_t block_size = stream->ctx->fs->block_size;
+
+    for (uint32_t i = 0; i < count && (uint64_t) (logical_block_num + i) * block_size < stream->size; i++) {
+        uint8_t *dest = stream->ctx->buffer + (size_t) (logical_block_num + i) * block_size;
+        if (!read_physical_blocks(stream->ctx->fs, dest, physical_block_num + i, 1)) return 0;
+    }
+
+    return 1;
+}
+
+static uint8_t export_symlink(struct export_ctx *ctx, const struct ext4_inode *inode, struct tar_entry *entry) {
+    const uint64_t size = get_inode_size(inode);
+    char *target = (char *) ctx->buffer;
+
+    // Short targets are stored right in i_block ("fast" symlinks)
+    if ((inode->i_flags & EXT4_INLINE_DATA_FL)
+        || (!(inode->i_flags & EXT4_EXTENTS_FL) && size < sizeof(inode->i_block))) {
+        memcpy(target, inode->i_block, size);
+    } else {
+        memset(target, 0, size);
+        struct file_stream stream = {.ctx = ctx, .size = size};
+        if (!walk_inode_blocks(ctx->fs, inode, read_symlink_run, &stream)) {
+            fprintf(stderr, "ERROR: Could not read symlink %s\n", ctx->path);
+            return 0;
+        }
+    }
+    target[size] = '\0';
+
+    entry->type = TAR_TYPE_SYMLINK;
+    entry->link_path = target;
+    return tar_write_header(&ctx->tw, entry) && tar_end_entry(&ctx->tw);
+}
+
+static uint8_t export_dir_entry(void *ctx, const struct ext4_dir_entry_2 *entry) {
+    struct export_ctx *export = ctx;
+
+    if (entry->name[0] == '.' && (entry->name_len == 1 || (entry->name_len == 2 && entry->name[1] == '.')))
+        return 1;
+
+    // Room for the separator, a trailing slash on directories and the terminator
+    if (export->path_len + entry->name_len + 3 > TAR_PATH_MAX) {
+        fprintf(stderr, "WARNING: Skipping %s/%.*s: path too long\n", export->path, entry->name_len, entry->name);
+        return 1;
+    }
+
+    const size_t parent_len = export->path_len;
+    export->path[export->path_len++] = '/';
+    memcpy(export->path + export->path_len, entry->name, entry->name_len);
+    export->path_len += entry->name_len;
+    export->path[export->path_len] = '\0';
+
+    const uint8_t result = export_inode(export, entry->inode);
+    if (!result) export->child_failed = 1;
+
+    export->path_len = parent_len;
+    export->path[parent_len] = '\0';
+    return result;
+}
+
+static uint8_t export_dir(struct export_ctx *ctx, const struct ext4_inode *inode, struct tar_entry *entry) {
+    // Directory entries are archived with a trailing slash, children are appended without it
+    ctx->path[ctx->path_len] = '/';
+    ctx->path[ctx->path_len + 1] = '\0';
+
+    entry->type = TAR_TYPE_DIR;
+    const uint8_t written = tar_write_header(&ctx->tw, entry) && tar_end_entry(&ctx->tw);
+
+    ctx->path[ctx->path_len] = '\0';
+    if (!written) return 0;
+
+    if (!walk_dir_entries(ctx->fs, inode, export_dir_entry, ctx)) {
+        if (ctx->child_failed) return 0;
+        fprintf(stderr, "ERROR: Could not export directory %s\n", ctx->path);
+        return 0;
+    }
+
+    return 1;
+}
+
+// Old encoding keeps 8-bit numbers in i_block[0], the new one uses i_block[1]
+static void decode_device(const struct ext4_inode *inode, uint32_t *major, uint32_t *minor) {
+    if (inode->i_block[0] != 0) {
+        *major = (inode->i_block[0] >> 8) & 0xFF;
+        *minor = inode->i_block[0] & 0xFF;
+    } else {
+        *major = (inode->i_block[1] & 0xFFF00) >> 8;
+        *minor = (inode->i_block[1] & 0xFF) | ((inode->i_block[1] >> 12) & 0xFFF00);
+    }
+}
+
+/*
+ * Checked before anything is archived for the inode, so that every link
+ * to an inode that cannot be exported is skipped the same way.
+ */
+static uint8_t is_exportable(const struct export_ctx *ctx, const struct ext4_inode *inode) {
+    const uint16_t type = inode->i_mode & EXT4_S_IFMT;
+    const uint64_t size = get_inode_size(inode);
+
+    if (type != EXT4_S_IFDIR && type != EXT4_S_IFREG && type != EXT4_S_IFLNK
+        && type != EXT4_S_IFCHR && type != EXT4_S_IFBLK && type != EXT4_S_IFIFO) {
+        fprintf(stderr, "WARNING: Skipping %s: file type not representable in tar\n", ctx->path);
+        return 0;
+    }
+
+    if (type == EXT4_S_IFLNK && size >= TAR_PATH_MAX) {
+        fprintf(stderr, "WARNING: Skipping %s: symlink target too long\n", ctx->path);
+        return 0;
+    }
+
+    if ((type == EXT4_S_IFREG || type == EXT4_S_IFLNK || type == EXT4_S_IFDIR)
+        && (inode->i_flags & EXT4_INLINE_DATA_FL) && size > sizeof(inode->i_block)) {
+        fprintf(stderr, "WARNING: Skipping %s: inline data in extended attributes is not supported\n",
+                ctx->path);
+        return 0;
+    }
+
+    return 1;
+}
+
+static uint8_t export_inode(struct export_ctx *ctx, uint32_t inode_num) {
+    struct ext4_inode inode;
+    if (!read_inode(ctx->fs, &inode, inode_num)) {
+        fprintf(stderr, "ERROR: Could not read inode %u of %s\n", inode_num, ctx->path);
+        return 0;
+    }
+
+    if (!is_exportable(ctx, &inode)) return 1;
+
+    const uint16_t type = inode.i_mode & EXT4_S_IFMT;
+    const uint8_t is_linked = type != EXT4_S_IFDIR && inode.i_links_count > 1;
+
+    struct tar_entry entry = {
+        .path = ctx->path,
+        .mode = inode.i_mode & 07777,
+        .uid = get_inode_uid(&inode),
+        .gid = get_inode_gid(&inode),
+        .mtime = to_tar_time(get_inode_mtime(&inode)),
+        .atime = to_tar_time(get_inode_atime(&inode)),
+        .ctime = to_tar_time(get_inode_ctime(&inode))
+    };
+
+    if (is_linked) {
+        const char *first_path = find_hardlink(ctx, inode_num);
+
+        if (first_path != NULL) {
+            entry.type = TAR_TYPE_HARDLINK;
+            entry.link_path = first_path;
+            return tar_write_header(&ctx->tw, &entry) && tar_end_entry(&ctx->tw);
+        }
+    }
+
+    uint8_t result;
+    switch (type) {
+        case EXT4_S_IFDIR: return export_dir(ctx, &inode, &entry);
+        case EXT4_S_IFREG: entry.type = TAR_TYPE_REGULAR;
+            result = export_regular(ctx, &inode, &entry);
+            break;
+        case EXT4_S_IFLNK: result = export_symlink(ctx, &inode, &entry);
+            break;
+        case EXT4_S_IFCHR:
+        case EXT4_S_IFBLK: entry.type = type == EXT4_S_IFCHR ? TAR_TYPE_CHAR : TAR_TYPE_BLOCK;
+            decode_device(&inode, &entry.dev_major, &entry.dev_minor);
+            result = tar_write_header(&ctx->tw, &entry) && tar_end_entry(&ctx->tw);
+            break;
+        default: entry.type = TAR_TYPE_FIFO;
+            result = tar_write_header(&ctx->tw, &entry) && tar_end_entry(&ctx->tw);
+            break;
+    }
+
+    return result && (!is_linked || remember_hardlink(ctx, inode_num));
+}
+
+uint8_t export_tar(struct ext4_fs *fs, const char *path, FILE *out) {
+    uint32_t inode_num;
+    struct ext4_inode inode;
+
+    if (!lookup_path(fs, path, &inode_num)) return 0;
+
+    if (inode_num == 0) {
+        fprintf(stderr, "ERROR: Path %s not found in image\n", path);
+        return 0;
+    }
+
+    if (!read_inode(fs, &inode, inode_num)) {
+        fprintf(stderr, "ERROR: Could not read inode %u of %s\n", inode_num, path);
+        return 0;
+    }
+
+    struct export_ctx *ctx = calloc(1, sizeof(struct export_ctx));
+    if (ctx == NULL) {
+        fprintf(stderr, "ERROR: Memory allocation for export failed\n");
+        return 0;
+    }
+
+    ctx->buffer = malloc(EXPORT_BUFFER_SIZE);
+    if (ctx->buffer == NULL) {
+        fprintf(stderr, "ERROR: Memory allocation for export buffer failed\n");
+        free(ctx);
+        return 0;
+    }
+
+    ctx->fs = fs;
+    init_tar_writer(&ctx->tw, out);
+
+    // Directories are archived as "./...", a single file under its own name
+    if ((inode.i_mode & EXT4_S_IFMT) == EXT4_S_IFDIR) {
+        strcpy(ctx->path, ".");
+    } else {
+        size_t end = strlen(path);
+        while (end > 0 && path[end - 1] == '/') end--;
+        size_t start = end;
+        while (start > 0 && path[start - 1] != '/') start--;
+        snprintf(ctx->path, TAR_PATH_MAX, "%.*s", (int) (end - start), path + start);
+    }
+    ctx->path_len = strlen(ctx->path);
+
+    // A skipped root would leave an empty archive, so it fails the export instead
+    const uint8_t result = is_exportable(ctx, &inode) && export_inode(ctx, inode_num) && tar_finish(&ctx->tw);
+
+    free_hardlinks(ctx);
+    free(ctx->buffer);
+    free(ctx);
+    return result;
+}
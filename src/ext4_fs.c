@@ -1,6 +1,10 @@
+// Must precede every system header so that off_t and fseeko are 64-bit
+#define _FILE_OFFSET_BITS 64
+
 #include "ext4_fs.h"
 
 #include <math.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +13,10 @@
 #include "ext4_structs.h"
 #include "ext4_utils.h"
 
+static uint8_t seek_image(struct ext4_fs *fs, uint64_t offset) {
+    return fseeko(fs->img, (off_t) offset, SEEK_SET) == 0;
+}
+
 uint8_t init_ext4_fs(const char *fname, struct ext4_fs *fs) {
     if (fname == NULL || fs == NULL) return -1;
 
@@ -16,30 +24,35 @@ uint8_t init_ext4_fs(const char *fname, struct ext4_fs *fs) {
 
     fs->img = fopen(fname, "rb");
     if (fs->img == NULL) {
-        printf("ERROR: Could not open file\n");
+        fprintf(stderr, "ERROR: Could not open file\n");
         return 1;
     }
 
-    fseek(fs->img, 0, SEEK_END);
-    fs->fs_size = ftell(fs->img);
+    const off_t img_size = fseeko(fs->img, 0, SEEK_END) == 0 ? ftello(fs->img) : -1;
+    if (img_size < 0) {
+        fprintf(stderr, "ERROR: Could not determine image size\n");
+        fclose(fs->img);
+        return 1;
+    }
+    fs->fs_size = (uint64_t) img_size;
     rewind(fs->img);
 
     fs->sb = malloc(sizeof(struct ext4_super_block));
     if (fs->sb == NULL) {
-        printf("ERROR: Memory allocation for superblock failed\n");
+        fprintf(stderr, "ERROR: Memory allocation for superblock failed\n");
         goto cleanup;
     }
 
     if (!read_primary_super_block(fs, fs->sb)) {
-        printf("ERROR: Could not read superblock\n");
+        fprintf(stderr, "ERROR: Could not read superblock\n");
         goto cleanup;
     }
 
     if (!is_valid_super_block(fs->sb)) {
-        printf("ERROR: Filesystem either not ext4 or primary superblock is damaged\n");
+        fprintf(stderr, "ERROR: Filesystem either not ext4 or primary superblock is damaged\n");
 
         if (!read_backup_super_block(fs, fs->sb)) {
-            printf("ERROR: No valid superblock backups found\n");
+            fprintf(stderr, "ERROR: No valid superblock backups found\n");
             goto cleanup;
         }
     }
@@ -47,9 +60,9 @@ uint8_t init_ext4_fs(const char *fname, struct ext4_fs *fs) {
     fs->block_size = 1024 << fs->sb->s_log_block_size;
 
     // Skip free space between superblock and GDT
-    const int32_t skip_after_sb = (int32_t) fs->block_size - ftell(fs->img);
+    const int64_t skip_after_sb = (int64_t) fs->block_size - ftello(fs->img);
     if (skip_after_sb > 0) {
-        fseek(fs->img, skip_after_sb, SEEK_CUR);
+        fseeko(fs->img, (off_t) skip_after_sb, SEEK_CUR);
     }
 
     fs->block_group_count = (uint32_t) ceil((double) fs->sb->s_blocks_count_lo / fs->sb->s_blocks_per_group);
@@ -57,19 +70,19 @@ uint8_t init_ext4_fs(const char *fname, struct ext4_fs *fs) {
 
     fs->gdt = malloc(sizeof(struct ext4_group_descriptor *) * fs->block_group_count);
     if (fs->gdt == NULL) {
-        printf("ERROR: Memory allocation for GDT failed\n");
+        fprintf(stderr, "ERROR: Memory allocation for GDT failed\n");
         goto cleanup;
     }
 
     for (int i = 0; i < fs->block_group_count; i++) {
         fs->gdt[i] = malloc(sizeof(struct ext4_group_descriptor));
         if (fs->gdt[i] == NULL) {
-            printf("ERROR: Memory allocation for group descriptor failed\n");
+            fprintf(stderr, "ERROR: Memory allocation for group descriptor failed\n");
             goto cleanup;
         }
 
         if (!read_group_descriptor(fs, fs->gdt[i])) {
-            printf("ERROR: Could not read group descriptor\n");
+            fprintf(stderr, "ERROR: Could not read group descriptor\n");
             goto cleanup;
         }
     }
@@ -87,6 +100,17 @@ cleanup:
     return 1;
 }
 
+void close_ext4_fs(struct ext4_fs *fs) {
+    if (fs->gdt != NULL) {
+        for (int i = 0; i < fs->block_group_count; i++)
+            free(fs->gdt[i]);
+        free(fs->gdt);
+    }
+    free(fs->sb);
+    if (fs->img != NULL) fclose(fs->img);
+    memset(fs, 0, sizeof(struct ext4_fs));
+}
+
 uint8_t read_primary_super_block(struct ext4_fs *fs, struct ext4_super_block *sb) {
     fseek(fs->img, 1024, SEEK_SET);
     return fread(sb, sizeof(struct ext4_super_block), 1, fs->img) == 1;
@@ -97,7 +121,7 @@ uint8_t read_super_block(struct ext4_fs *fs, struct ext4_super_block *sb, uint32
 }
 
 uint8_t read_backup_super_block(struct ext4_fs *fs, struct ext4_super_block *sb) {
-    printf("Trying to read superblock backup...\n");
+    fprintf(stderr, "Trying to read superblock backup...\n");
 
     const uint32_t common_block_sizes[4] = {4096, 1024, 2048, 8192};
     // Block groups 1, 3, 5, 7 and 9
@@ -110,33 +134,27 @@ uint8_t read_backup_super_block(struct ext4_fs *fs, struct ext4_super_block *sb)
 
     struct ext4_super_block super_block_backup;
     for (int i = 0; i < 4; i++) {
-        printf("%dK blocks:\n", common_block_sizes[i] / 1024);
+        fprintf(stderr, "%dK blocks:\n", common_block_sizes[i] / 1024);
 
         for (int j = 0; j < 5; j++) {
-            printf("  Block %d: ", common_backup_blocks[i][j]);
+            fprintf(stderr, "  Block %d: ", common_backup_blocks[i][j]);
 
-            uint64_t offset = common_backup_blocks[i][j] * common_block_sizes[i];
+            uint64_t offset = (uint64_t) common_backup_blocks[i][j] * common_block_sizes[i];
 
             if (fs->fs_size < offset) {
-                printf("SKIPPED (beyond filesystem size)\n");
-                break;
-            }
-
-            if (offset > LONG_MAX) {
-                printf("SKIPPED (long overflow)\n");
+                fprintf(stderr, "SKIPPED (beyond filesystem size)\n");
                 break;
             }
 
-            fseeko64(fs->img, offset, SEEK_SET);
-            fread(&super_block_backup, sizeof(struct ext4_super_block), 1, fs->img);
-
-            if (is_valid_super_block(&super_block_backup)) {
+            if (seek_image(fs, offset)
+                && fread(&super_block_backup, sizeof(struct ext4_super_block), 1, fs->img) == 1
+                && is_valid_super_block(&super_block_backup)) {
                 memcpy(fs->sb, &super_block_backup, sizeof(struct ext4_super_block));
-                printf("SUCCEED\n");
+                fprintf(stderr, "SUCCEED\n");
                 return 1;
             }
 
-            printf("FAILED\n");
+            fprintf(stderr, "FAILED\n");
         }
     }
     return 0;
@@ -146,21 +164,32 @@ uint8_t read_group_descriptor(struct ext4_fs *fs, struct ext4_group_descriptor *
     return fread(gd, sizeof(struct ext4_group_descriptor), 1, fs->img) == 1;
 }
 
-// TODO: Rewrite?
 uint8_t read_inode(struct ext4_fs *fs, struct ext4_inode *inode, uint32_t inode_num) {
+    if (inode_num == 0 || inode_num > fs->sb->s_inodes_count) return 0;
+
     const uint32_t inode_bg_num = (inode_num - 1) / fs->inodes_per_group;
     const uint32_t relative_inode_num = (inode_num - 1) % fs->inodes_per_group;
     const struct ext4_group_descriptor *related_gd = fs->gdt[inode_bg_num];
-    const int32_t offset = (int32_t) (related_gd->gd_inode_table_lo * fs->block_size
-                                      + relative_inode_num * sizeof(struct ext4_inode));
 
-    fseek(fs->img, offset, SEEK_SET);
-    return fread(inode, sizeof(struct ext4_inode), 1, fs->img) == 1;
+    // Revision 0 filesystems leave s_inode_size unset
+    const uint32_t inode_size = fs->sb->s_rev_level == 0 ? EXT4_GOOD_OLD_INODE_SIZE : fs->sb->s_inode_size;
+    const uint32_t read_size = inode_size < sizeof(struct ext4_inode) ? inode_size : sizeof(struct ext4_inode);
+    const uint64_t offset = (uint64_t) related_gd->gd_inode_table_lo * fs->block_size
+                            + (uint64_t) relative_inode_num * inode_size;
+
+    // Fields past the on-disk inode size (e.g. *_extra) must read as absent
+    memset(inode, 0, sizeof(struct ext4_inode));
+
+    return seek_image(fs, offset) && fread(inode, read_size, 1, fs->img) == 1;
 }
 
 uint8_t read_physical_block(struct ext4_fs *fs, uint8_t *buffer, uint32_t physical_block_num) {
-    fseek(fs->img, physical_block_num * fs->block_size, SEEK_SET);
-    return fread(buffer, fs->block_size, 1, fs->img) == 1;
+    return read_physical_blocks(fs, buffer, physical_block_num, 1);
+}
+
+uint8_t read_physical_blocks(struct ext4_fs *fs, uint8_t *buffer, uint64_t physical_block_num, uint32_t count) {
+    return seek_image(fs, physical_block_num * fs->block_size)
+           && fread(buffer, fs->block_size, count, fs->img) == count;
 }
 
 uint8_t read_logical_block(struct ext4_fs *fs, struct ext4_inode *inode, uint8_t *buffer, uint32_t logical_block_num) {
@@ -215,6 +244,334 @@ uint8_t read_logical_block(struct ext4_fs *fs, struct ext4_inode *inode, uint8_t
     return read_physical_block(fs, buffer, physical_block_num) == 1;
 }
 
+struct block_run {
+    ext4_block_run_cb cb;
+    void *ctx;
+    uint64_t logical_block_num;
+    uint64_t physical_block_num;
+    uint32_t count;
+};
+
+static uint8_t flush_block_run(struct block_run *run) {
+    if (run->count == 0) return 1;
+
+    const uint8_t keep_going = run->cb(run->ctx, (uint32_t) run->logical_block_num, run->physical_block_num, run->count);
+    run->count = 0;
+    return keep_going;
+}
+
+// Merges blocks into the pending run while they stay contiguous both logically and physically
+static uint8_t add_block_run(struct block_run *run, uint64_t logical_block_num, uint64_t physical_block_num,
+                             uint32_t count) {
+    if (run->count > 0
+        && run->logical_block_num + run->count == logical_block_num
+        && run->physical_block_num + run->count == physical_block_num
+        && run->count <= UINT32_MAX - count) {
+        run->count += count;
+        return 1;
+    }
+
+    if (!flush_block_run(run)) return 0;
+
+    run->logical_block_num = logical_block_num;
+    run->physical_block_num = physical_block_num;
+    run->count = count;
+    return 1;
+}
+
+static uint8_t walk_indirect_block(struct ext4_fs *fs, struct block_run *run, uint32_t block_num, uint8_t level,
+                                   uint64_t *logical_block_num) {
+    const uint32_t entries_per_block = fs->block_size / sizeof(uint32_t);
+
+    if (block_num == 0) {
+        *logical_block_num += fast_pow(entries_per_block, level);
+        return 1;
+    }
+
+    uint32_t *block_buffer = (uint32_t *) malloc(fs->block_size);
+    if (block_buffer == NULL) {
+        fprintf(stderr, "ERROR: Memory allocation for indirect block failed\n");
+        return 0;
+    }
+
+    if (!read_physical_block(fs, (uint8_t *) block_buffer, block_num)) {
+        fprintf(stderr, "ERROR: Could not read indirect block %u\n", block_num);
+        free(block_buffer);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < entries_per_block; i++) {
+        if (level > 1) {
+            if (!walk_indirect_block(fs, run, block_buffer[i], level - 1, logical_block_num)) {
+                free(block_buffer);
+                return 0;
+            }
+            continue;
+        }
+
+        if (block_buffer[i] != 0 && !add_block_run(run, *logical_block_num, block_buffer[i], 1)) {
+            free(block_buffer);
+            return 0;
+        }
+        (*logical_block_num)++;
+    }
+
+    free(block_buffer);
+    return 1;
+}
+
+static uint8_t walk_block_map(struct ext4_fs *fs, const struct ext4_inode *inode, struct block_run *run) {
+    uint64_t logical_block_num = 0;
+
+    for (; logical_block_num < 12; logical_block_num++) {
+        const uint32_t block_num = inode->i_block[logical_block_num];
+        if (block_num != 0 && !add_block_run(run, logical_block_num, block_num, 1)) return 0;
+    }
+
+    for (uint8_t level = 1; level <= 3; level++) {
+        if (!walk_indirect_block(fs, run, inode->i_block[11 + level], level, &logical_block_num)) return 0;
+    }
+
+    return 1;
+}
+
+static uint8_t walk_extent_node(struct ext4_fs *fs, const struct ext4_extent_header *header, uint32_t node_size,
+                                struct block_run *run) {
+    if (header->eh_magic != EXT4_EXT_MAGIC
+        || sizeof(struct ext4_extent_header) + header->eh_entries * sizeof(struct ext4_extent) > node_size) {
+        fprintf(stderr, "ERROR: Corrupted extent tree node\n");
+        return 0;
+    }
+
+    if (header->eh_depth == 0) {
+        const struct ext4_extent *extents = (const struct ext4_extent *) (header + 1);
+
+        for (uint16_t i = 0; i < header->eh_entries; i++) {
+            // Uninitialized extents read back as zeros, so they are reported as holes
+            if (extents[i].ee_len > EXT4_EXT_INIT_MAX_LEN) continue;
+
+            const uint64_t physical_block_num = (uint64_t) extents[i].ee_start_hi << 32 | extents[i].ee_start_lo;
+            if (!add_block_run(run, extents[i].ee_block, physical_block_num, extents[i].ee_len)) return 0;
+        }
+
+        return 1;
+    }
+
+    const struct ext4_extent_idx *indexes = (const struct ext4_extent_idx *) (header + 1);
+
+    uint8_t *block_buffer = (uint8_t *) malloc(fs->block_size);
+    if (block_buffer == NULL) {
+        fprintf(stderr, "ERROR: Memory allocation for extent tree block failed\n");
+        return 0;
+    }
+
+    for (uint16_t i = 0; i < header->eh_entries; i++) {
+        const uint64_t leaf_block_num = (uint64_t) indexes[i].ei_leaf_hi << 32 | indexes[i].ei_leaf_lo;
+        const struct ext4_extent_header *child = (const struct ext4_extent_header *) block_buffer;
+
+        if (!read_physical_blocks(fs, block_buffer, leaf_block_num, 1)) {
+            fprintf(stderr, "ERROR: Could not read extent tree block %llu\n", (unsigned long long) leaf_block_num);
+            free(block_buffer);
+            return 0;
+        }
+
+        if (child->eh_depth != header->eh_depth - 1) {
+            fprintf(stderr, "ERROR: Corrupted extent tree node\n");
+            free(block_buffer);
+            return 0;
+        }
+
+        if (!walk_extent_node(fs, child, fs->block_size, run)) {
+            free(block_buffer);
+            return 0;
+        }
+    }
+
+    free(block_buffer);
+    return 1;
+}
+
+uint8_t walk_inode_blocks(struct ext4_fs *fs, const struct ext4_inode *inode, ext4_block_run_cb cb, void *ctx) {
+    // Inline data lives in i_block itself and owns no blocks
+    if (inode->i_flags & EXT4_INLINE_DATA_FL) return 1;
+
+    struct block_run run = {.cb = cb, .ctx = ctx};
+    uint8_t result;
+
+    if (inode->i_flags & EXT4_EXTENTS_FL) {
+        result = walk_extent_node(fs, (const struct ext4_extent_header *) inode->i_block, sizeof(inode->i_block), &run);
+    } else {
+        result = walk_block_map(fs, inode, &run);
+    }
+
+    return result && flush_block_run(&run);
+}
+
+struct dir_walk {
+    struct ext4_fs *fs;
+    ext4_dir_entry_cb cb;
+    void *ctx;
+    uint8_t *block_buffer;
+};
+
+static uint8_t walk_dir_buffer(const struct dir_walk *walk, const uint8_t *buffer, uint32_t size) {
+    const uint32_t header_size = offsetof(struct ext4_dir_entry_2, name);
+    uint32_t offset = 0;
+
+    while (offset + header_size <= size) {
+        const struct ext4_dir_entry_2 *entry = (const struct ext4_dir_entry_2 *) (buffer + offset);
+
+        if (entry->rec_len < header_size || entry->rec_len % 4 != 0 || entry->rec_len > size - offset) {
+            fprintf(stderr, "ERROR: Corrupted directory entry\n");
+            return 0;
+        }
+
+        // Unused entries, htree nodes and checksum tails all carry inode 0
+        if (entry->inode != 0 && entry->name_len > 0 && header_size + entry->name_len <= entry->rec_len) {
+            if (!walk->cb(walk->ctx, entry)) return 0;
+        }
+
+        offset += entry->rec_len;
+    }
+
+    return 1;
+}
+
+static uint8_t walk_dir_run(void *ctx, uint32_t logical_block_num, uint64_t physical_block_num, uint32_t count) {
+    const struct dir_walk *walk = ctx;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (!read_physical_blocks(walk->fs, walk->block_buffer, physical_block_num + i, 1)) {
+            fprintf(stderr, "ERROR: Could not read directory block %llu\n",
+                    (unsigned long long) (physical_block_num + i));
+            return 0;
+        }
+        if (!walk_dir_buffer(walk, walk->block_buffer, walk->fs->block_size)) return 0;
+    }
+
+    return 1;
+}
+
+uint8_t walk_dir_entries(struct ext4_fs *fs, const struct ext4_inode *dir, ext4_dir_entry_cb cb, void *ctx) {
+    struct dir_walk walk = {.fs = fs, .cb = cb, .ctx = ctx};
+
+    // Inline directories start with the parent inode number instead of "." and ".." entries
+    if (dir->i_flags & EXT4_INLINE_DATA_FL) {
+        // Entries past i_block live in the system.data xattr, which is not read
+        if (get_inode_size(dir) > sizeof(dir->i_block)) {
+            fprintf(stderr, "ERROR: Inline directory entries in extended attributes are not supported\n");
+            return 0;
+        }
+
+        return walk_dir_buffer(&walk, (const uint8_t *) dir->i_block + sizeof(uint32_t),
+                               sizeof(dir->i_block) - sizeof(uint32_t));
+    }
+
+    walk.block_buffer = (uint8_t *) malloc(fs->block_size);
+    if (walk.block_buffer == NULL) {
+        fprintf(stderr, "ERROR: Memory allocation for directory block failed\n");
+        return 0;
+    }
+
+    const uint8_t result = walk_inode_blocks(fs, dir, walk_dir_run, &walk);
+
+    free(walk.block_buffer);
+    return result;
+}
+
+struct path_lookup {
+    const char *name;
+    size_t name_len;
+    uint32_t inode_num;
+    uint8_t found;
+};
+
+static uint8_t match_dir_entry(void *ctx, const struct ext4_dir_entry_2 *entry) {
+    struct path_lookup *lookup = ctx;
+
+    if (entry->name_len == lookup->name_len && memcmp(entry->name, lookup->name, lookup->name_len) == 0) {
+        lookup->inode_num = entry->inode;
+        lookup->found = 1;
+        return 0;
+    }
+
+    return 1;
+}
+
+// Sets inode_num to 0 if the path does not exist, returns 0 only on read errors
+uint8_t lookup_path(struct ext4_fs *fs, const char *path, uint32_t *inode_num) {
+    uint32_t current = EXT4_ROOT_INO;
+    struct ext4_inode inode;
+
+    *inode_num = 0;
+
+    while (*path != '\0') {
+        while (*path == '/') path++;
+        if (*path == '\0') break;
+
+        struct path_lookup lookup = {.name = path, .name_len = strcspn(path, "/")};
+        path += lookup.name_len;
+
+        if (!read_inode(fs, &inode, current)) {
+            fprintf(stderr, "ERROR: Could not read inode %u\n", current);
+            return 0;
+        }
+        if ((inode.i_mode & EXT4_S_IFMT) != EXT4_S_IFDIR) return 1;
+
+        // The walk stops early on a match, so its result only matters when nothing was found
+        if (!walk_dir_entries(fs, &inode, match_dir_entry, &lookup) && !lookup.found) {
+            fprintf(stderr, "ERROR: Could not read directory inode %u\n", current);
+            return 0;
+        }
+        if (!lookup.found) return 1;
+
+        current = lookup.inode_num;
+    }
+
+    *inode_num = current;
+    return 1;
+}
+
+uint64_t get_inode_size(const struct ext4_inode *inode) {
+    return (uint64_t) inode->i_size_high << 32 | inode->i_size_lo;
+}
+
+uint32_t get_inode_uid(const struct ext4_inode *inode) {
+    return (uint32_t) inode->osd2.linux2.l_i_uid_high << 16 | inode->i_uid;
+}
+
+uint32_t get_inode_gid(const struct ext4_inode *inode) {
+    return (uint32_t) inode->osd2.linux2.l_i_gid_high << 16 | inode->i_gid;
+}
+
+/*
+ * The *_extra fields only exist when i_extra_isize covers them. Their low
+ * 2 bits extend the signed 32-bit seconds past 2038, the rest are nanoseconds.
+ */
+static struct ext4_time decode_inode_time(const struct ext4_inode *inode, uint32_t seconds, uint32_t extra,
+                                          size_t extra_offset) {
+    struct ext4_time time = {.sec = (int32_t) seconds, .nsec = 0};
+
+    if ((size_t) EXT4_GOOD_OLD_INODE_SIZE + inode->i_extra_isize >= extra_offset + sizeof(uint32_t)) {
+        time.sec += (int64_t) (extra & 3) << 32;
+        time.nsec = extra >> 2;
+    }
+
+    return time;
+}
+
+struct ext4_time get_inode_atime(const struct ext4_inode *inode) {
+    return decode_inode_time(inode, inode->i_atime, inode->i_atime_extra, offsetof(struct ext4_inode, i_atime_extra));
+}
+
+struct ext4_time get_inode_mtime(const struct ext4_inode *inode) {
+    return decode_inode_time(inode, inode->i_mtime, inode->i_mtime_extra, offsetof(struct ext4_inode, i_mtime_extra));
+}
+
+struct ext4_time get_inode_ctime(const struct ext4_inode *inode) {
+    return decode_inode_time(inode, inode->i_ctime, inode->i_ctime_extra, offsetof(struct ext4_inode, i_ctime_extra));
+}
+
 uint8_t is_valid_super_block(struct ext4_super_block *sb) {
     if (sb->s_magic != EXT4_S_MAGIC) {
         return 0;
@@ -1,46 +1,36 @@
 #include <stdio.h>
-#include <stdlib.h>
+#include <string.h>
 
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include "ext4_export.h"
 #include "ext4_fs.h"
 
-/*
- * Currently, main.c is used only for testing functions and contains
- * random shit. Any useful functionality will be added later.
- * If you're reading this and no meaningful functionality has been
- * implemented yet, read the previous statement again.
- */
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s <image> export [path]\n", program);
+    fprintf(stderr, "  export  Write the subtree at path (default: /) to stdout as a pax archive\n");
+}
 
-int main(void) {
-    struct ext4_fs fs;
-    init_ext4_fs("../test_ext4_x32.img", &fs);
-
-    // printf("Total inodes: %d\n", fs.sb->s_inodes_count);
-    // printf("Total block groups: %d\n", fs.block_group_count);
-    // printf("Inode table location: %d\n", fs.gdt[0]->gd_inode_table_lo);
-
-    struct ext4_inode inode;
-    read_inode(&fs, &inode, 24);
-
-    for (int i = 0; i < 15; i++)
-        printf("%d ", inode.i_block[i]);
-
-    // Testing reading with inodes
-    int not_null_blocks = 0;
-    for (int i = 0; i < 15; i++)
-        if (inode.i_block[i] != 0)
-            not_null_blocks++;
-
-    char *buffer = (char *) malloc(fs.block_size * not_null_blocks);
-    for (int i = 0; i < not_null_blocks; i++) {
-        fseek(fs.img, inode.i_block[i] * fs.block_size, SEEK_SET);
-        if (fread(buffer + fs.block_size * i, fs.block_size, 1, fs.img) != 1) {
-            printf("Error reading file\n");
-        }
+int main(int argc, char **argv) {
+    if (argc < 3 || argc > 4 || strcmp(argv[2], "export") != 0) {
+        print_usage(argv[0]);
+        return 2;
     }
 
-    fwrite(buffer, fs.block_size * not_null_blocks, 1, stdout);
+#ifdef _WIN32
+    // The archive is binary, text mode would mangle every '\n' byte
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+    struct ext4_fs fs;
+    if (init_ext4_fs(argv[1], &fs) != 0) return 1;
+
+    const uint8_t result = export_tar(&fs, argc == 4 ? argv[3] : "/", stdout);
 
-    free(buffer);
+    close_ext4_fs(&fs);
 
-    return 0;
+    return result ? 0 : 1;
 }
@@ -0,0 +1,263 @@
+#include "tar_writer.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#define USTAR_NAME_LEN 100
+#define USTAR_MAX_ID 07777777ULL
+#define USTAR_MAX_SIZE 077777777777ULL
+#define USTAR_MAX_TIME 077777777777LL
+
+struct ustar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} __attribute__((packed));
+
+static const uint8_t zero_block[TAR_BLOCK_SIZE];
+
+static uint8_t report_write_error(struct tar_writer *tw) {
+    if (!tw->write_failed) {
+        fprintf(stderr, "ERROR: Could not write archive: %s\n", strerror(errno));
+        tw->write_failed = 1;
+    }
+    return 0;
+}
+
+static uint8_t write_bytes(struct tar_writer *tw, const void *data, size_t len) {
+    if (tw->write_failed) return 0;
+    if (len == 0 || fwrite(data, len, 1, tw->out) == 1) return 1;
+    return report_write_error(tw);
+}
+
+static uint8_t write_padding(struct tar_writer *tw, uint64_t written) {
+    const size_t tail = written % TAR_BLOCK_SIZE;
+    return tail == 0 || write_bytes(tw, zero_block, TAR_BLOCK_SIZE - tail);
+}
+
+// Values that do not fit are zeroed, the pax header carries them instead
+static void put_octal(char *field, size_t width, uint64_t value) {
+    if (value >> (3 * (width - 1)) != 0) value = 0;
+    snprintf(field, width, "%0*" PRIo64, (int) (width - 1), value);
+}
+
+static const char *get_basename(const char *path, size_t *len) {
+    size_t end = strlen(path);
+    while (end > 1 && path[end - 1] == '/') end--;
+
+    size_t start = end;
+    while (start > 0 && path[start - 1] != '/') start--;
+
+    *len = end - start;
+    return path + start;
+}
+
+// ustar fields need no terminator, longer values are cut and carried by the pax header
+static void put_string(char *field, size_t width, const char *value) {
+    const size_t len = strlen(value);
+    memcpy(field, value, len < width ? len : width);
+}
+
+static void format_time(char *buffer, size_t size, struct tar_time time) {
+    if (time.nsec == 0) {
+        snprintf(buffer, size, "%" PRId64, time.sec);
+    } else if (time.sec < 0) {
+        // pax times are a single decimal number, so -1.25 is sec = -2, nsec = 750000000
+        snprintf(buffer, size, "-%" PRId64 ".%09" PRIu32, -(time.sec + 1), 1000000000 - time.nsec);
+    } else {
+        snprintf(buffer, size, "%" PRId64 ".%09" PRIu32, time.sec, time.nsec);
+    }
+}
+
+static size_t count_digits(uint64_t value) {
+    size_t digits = 1;
+    while (value >= 10) {
+        value /= 10;
+        digits++;
+    }
+    return digits;
+}
+
+// Each record is "<len> <key>=<value>\n" where len counts the whole record, itself included
+static uint8_t add_pax_record(struct tar_writer *tw, const char *key, const char *value) {
+    const size_t payload = strlen(key) + strlen(value) + 3;
+    size_t len = payload + count_digits(payload);
+    while (len != payload + count_digits(len))
+        len = payload + count_digits(len);
+
+    if (tw->pax_len + len + 1 > sizeof(tw->pax)) {
+        fprintf(stderr, "ERROR: pax header too long\n");
+        return 0;
+    }
+
+    tw->pax_len += snprintf(tw->pax + tw->pax_len, len + 1, "%zu %s=%s\n", len, key, value);
+    return 1;
+}
+
+static uint8_t add_pax_number(struct tar_writer *tw, const char *key, uint64_t value) {
+    char buffer[24];
+    snprintf(buffer, sizeof(buffer), "%" PRIu64, value);
+    return add_pax_record(tw, key, buffer);
+}
+
+static uint8_t add_pax_time(struct tar_writer *tw, const char *key, struct tar_time time) {
+    char buffer[32];
+    format_time(buffer, sizeof(buffer), time);
+    return add_pax_record(tw, key, buffer);
+}
+
+static uint8_t write_ustar_header(struct tar_writer *tw, const struct tar_entry *entry) {
+    struct ustar_header header;
+    memset(&header, 0, sizeof(header));
+
+    put_string(header.name, sizeof(header.name), entry->path);
+    if (entry->link_path != NULL) put_string(header.linkname, sizeof(header.linkname), entry->link_path);
+
+    put_octal(header.mode, sizeof(header.mode), entry->mode);
+    put_octal(header.uid, sizeof(header.uid), entry->uid);
+    put_octal(header.gid, sizeof(header.gid), entry->gid);
+    put_octal(header.size, sizeof(header.size), entry->size);
+    put_octal(header.mtime, sizeof(header.mtime), entry->mtime.sec < 0 ? 0 : (uint64_t) entry->mtime.sec);
+
+    header.typeflag = entry->type;
+    memcpy(header.magic, "ustar", sizeof(header.magic));
+    memcpy(header.version, "00", sizeof(header.version));
+
+    if (entry->type == TAR_TYPE_CHAR || entry->type == TAR_TYPE_BLOCK) {
+        put_octal(header.devmajor, sizeof(header.devmajor), entry->dev_major);
+        put_octal(header.devminor, sizeof(header.devminor), entry->dev_minor);
+    }
+
+    // Checksum is computed with the checksum field itself filled with spaces
+    memset(header.chksum, ' ', sizeof(header.chksum));
+    uint32_t checksum = 0;
+    for (size_t i = 0; i < sizeof(header); i++)
+        checksum += ((const uint8_t *) &header)[i];
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", checksum);
+    header.chksum[7] = ' ';
+
+    return write_bytes(tw, &header, sizeof(header));
+}
+
+void init_tar_writer(struct tar_writer *tw, FILE *out) {
+    memset(tw, 0, sizeof(struct tar_writer));
+    tw->out = out;
+}
+
+uint8_t tar_write_header(struct tar_writer *tw, const struct tar_entry *entry) {
+    struct tar_entry ustar = *entry;
+    char ustar_path[USTAR_NAME_LEN + 1];
+    size_t basename_len;
+    const char *basename = get_basename(entry->path, &basename_len);
+
+    tw->pax_len = 0;
+
+    if (entry->sparse) {
+        // GNU sparse 1.0 hides the real name so that non-GNU readers do not extract the raw map
+        snprintf(ustar_path, sizeof(ustar_path), "GNUSparseFile.0/%.*s", (int) basename_len, basename);
+        ustar.path = ustar_path;
+
+        if (!add_pax_record(tw, "GNU.sparse.major", "1")
+            || !add_pax_record(tw, "GNU.sparse.minor", "0")
+            || !add_pax_record(tw, "GNU.sparse.name", entry->path)
+            || !add_pax_number(tw, "GNU.sparse.realsize", entry->real_size))
+            return 0;
+    } else if (strlen(entry->path) > USTAR_NAME_LEN) {
+        if (!add_pax_record(tw, "path", entry->path)) return 0;
+    }
+
+    if (entry->link_path != NULL && strlen(entry->link_path) > USTAR_NAME_LEN) {
+        if (!add_pax_record(tw, "linkpath", entry->link_path)) return 0;
+    }
+
+    if (entry->uid > USTAR_MAX_ID && !add_pax_number(tw, "uid", entry->uid)) return 0;
+    if (entry->gid > USTAR_MAX_ID && !add_pax_number(tw, "gid", entry->gid)) return 0;
+    if (entry->size > USTAR_MAX_SIZE && !add_pax_number(tw, "size", entry->size)) return 0;
+
+    if (entry->mtime.nsec != 0 || entry->mtime.sec < 0 || entry->mtime.sec > USTAR_MAX_TIME) {
+        if (!add_pax_time(tw, "mtime", entry->mtime)) return 0;
+    }
+
+    if (!add_pax_time(tw, "atime", entry->atime) || !add_pax_time(tw, "ctime", entry->ctime)) return 0;
+
+    char pax_path[USTAR_NAME_LEN + 1];
+    snprintf(pax_path, sizeof(pax_path), "PaxHeaders/%.*s", (int) basename_len, basename);
+
+    const struct tar_entry pax = {
+        .path = pax_path,
+        .type = TAR_TYPE_PAX,
+        .mode = 0644,
+        .size = tw->pax_len,
+        .mtime = {.sec = entry->mtime.sec}
+    };
+
+    if (!write_ustar_header(tw, &pax)
+        || !write_bytes(tw, tw->pax, tw->pax_len)
+        || !write_padding(tw, tw->pax_len))
+        return 0;
+
+    if (!write_ustar_header(tw, &ustar)) return 0;
+
+    tw->entry_remaining = entry->size;
+    tw->entry_written = 0;
+    return 1;
+}
+
+uint8_t tar_write_data(struct tar_writer *tw, const void *data, size_t len) {
+    if (len > tw->entry_remaining) {
+        fprintf(stderr, "ERROR: Entry data exceeds its declared size\n");
+        return 0;
+    }
+
+    if (!write_bytes(tw, data, len)) return 0;
+
+    tw->entry_remaining -= len;
+    tw->entry_written += len;
+    return 1;
+}
+
+// Pads the entry data written so far up to the next block boundary, counting the padding as data
+uint8_t tar_align_data(struct tar_writer *tw) {
+    const size_t tail = tw->entry_written % TAR_BLOCK_SIZE;
+    return tail == 0 || tar_write_data(tw, zero_block, TAR_BLOCK_SIZE - tail);
+}
+
+uint8_t tar_end_entry(struct tar_writer *tw) {
+    if (tw->entry_remaining != 0) {
+        fprintf(stderr, "ERROR: Entry data is shorter than its declared size\n");
+        return 0;
+    }
+
+    return write_padding(tw, tw->entry_written);
+}
+
+uint8_t tar_finish(struct tar_writer *tw) {
+    if (!write_bytes(tw, zero_block, TAR_BLOCK_SIZE) || !write_bytes(tw, zero_block, TAR_BLOCK_SIZE)) return 0;
+    return fflush(tw->out) == 0 || report_write_error(tw);
+}
+
+uint8_t tar_write_sparse_map_value(struct tar_writer *tw, uint64_t value) {
+    char buffer[24];
+    const int len = snprintf(buffer, sizeof(buffer), "%" PRIu64 "\n", value);
+    return tar_write_data(tw, buffer, len);
+}
+
+uint64_t tar_sparse_map_value_size(uint64_t value) {
+    return count_digits(value) + 1;
+}